@@ -0,0 +1,316 @@
+/*Binary .hack image format, written by the Assembler with --binary and read by anything that runs Hack programs.
+All fields are little-endian, so on x86/ARM hosts the ROM words can be used straight from a memory mapping.
+
+    offset  size  field
+    0       4     magic "HACK"
+    4       2     version (1)
+    6       2     flags (HACK_BINARY_SYMBOLS if a symbol section follows the words)
+    8       4     word count
+    12      4     symbol count
+    16      2*n   ROM words
+    ...           symbol section: for every symbol {uint16 address, uint16 kind, uint16 name length, name bytes}
+
+hack_image_load() also accepts the usual text .hack files, so a loader does not have to care which one it got.
+
+The Assembler's --map option writes the same symbols as text, one "label|variable address name" per line
+(// lines are comments). hack_map_load() reads such a file into the symbols of an image.*/
+#ifndef HACK_BINARY_H
+#define HACK_BINARY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define HACK_BINARY_MAGIC "HACK"
+#define HACK_BINARY_VERSION 1
+#define HACK_BINARY_HEADER_SIZE 16
+#define HACK_BINARY_SYMBOLS 0x1
+
+typedef enum{
+    SYMBOL_PREDEFINED,
+    SYMBOL_LABEL, //ROM address
+    SYMBOL_VARIABLE //RAM address
+}symbol_kind;
+
+typedef struct{
+    char *name;
+    int address;
+    symbol_kind kind;
+}hack_symbol;
+
+typedef struct{
+    const uint16_t *rom; //host byte order
+    uint32_t word_count;
+    hack_symbol *symbols;
+    uint32_t symbol_count;
+    //private:
+    uint8_t *data;
+    size_t data_size;
+    int mapped;
+    uint16_t *rom_copy;
+}hack_image;
+
+static inline void put_le16(uint8_t *p, uint16_t v)
+{
+    p[0]=v&0xFF;
+    p[1]=v>>8;
+}
+
+static inline void put_le32(uint8_t *p, uint32_t v)
+{
+    for(int i=0; i<4; i++)
+        p[i]=(v>>(8*i))&0xFF;
+}
+
+static inline uint16_t get_le16(const uint8_t *p)
+{
+    return (uint16_t)(p[0]|(p[1]<<8));
+}
+
+static inline uint32_t get_le32(const uint8_t *p)
+{
+    return (uint32_t)p[0]|((uint32_t)p[1]<<8)|((uint32_t)p[2]<<16)|((uint32_t)p[3]<<24);
+}
+
+static inline int host_is_little_endian()
+{
+    uint16_t one=1;
+    return *(uint8_t*)&one==1;
+}
+
+static inline void hack_binary_header(uint8_t *header, uint32_t word_count, uint32_t symbol_count)
+{
+    memcpy(header, HACK_BINARY_MAGIC, 4);
+    put_le16(header+4, HACK_BINARY_VERSION);
+    put_le16(header+6, symbol_count>0 ? HACK_BINARY_SYMBOLS : 0);
+    put_le32(header+8, word_count);
+    put_le32(header+12, symbol_count);
+}
+
+static inline int hack_image_map(const char *filename, hack_image *img)
+{
+#ifndef _WIN32
+    int fd=open(filename, O_RDONLY);
+    if(fd<0)
+        return 0;
+    struct stat st;
+    if(fstat(fd, &st)!=0)
+    {
+        close(fd);
+        return 0;
+    }
+    img->data_size=st.st_size;
+    if(img->data_size>0)
+    {
+        void *p=mmap(NULL, img->data_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(p!=MAP_FAILED)
+        {
+            close(fd);
+            img->data=(uint8_t*)p;
+            img->mapped=1;
+            return 1;
+        }
+    }
+    close(fd);
+#endif
+    //no mmap: read the whole file instead
+    FILE *f=fopen(filename, "rb");
+    if(f==NULL)
+        return 0;
+    fseek(f, 0, SEEK_END);
+    long size=ftell(f);
+    rewind(f);
+    img->data=(uint8_t*)malloc(size>0 ? size : 1);
+    if(size<0 || img->data==NULL || (long)fread(img->data, 1, size, f)!=size)
+    {
+        free(img->data);
+        img->data=NULL;
+        fclose(f);
+        return 0;
+    }
+    fclose(f);
+    img->data_size=size;
+    img->mapped=0;
+    return 1;
+}
+
+static inline int hack_image_load_binary(hack_image *img)
+{
+    if(img->data_size<HACK_BINARY_HEADER_SIZE || get_le16(img->data+4)!=HACK_BINARY_VERSION)
+        return 0;
+    img->word_count=get_le32(img->data+8);
+    img->symbol_count=get_le32(img->data+12);
+    size_t end=HACK_BINARY_HEADER_SIZE+2*(size_t)img->word_count;
+    if(end>img->data_size)
+        return 0;
+    const uint8_t *words=img->data+HACK_BINARY_HEADER_SIZE;
+    if(host_is_little_endian())
+        img->rom=(const uint16_t*)words; //the header keeps the words 2-byte aligned
+    else
+    {
+        img->rom_copy=(uint16_t*)malloc((img->word_count+1)*sizeof(uint16_t));
+        if(img->rom_copy==NULL)
+            return 0;
+        for(uint32_t i=0; i<img->word_count; i++)
+            img->rom_copy[i]=get_le16(words+2*i);
+        img->rom=img->rom_copy;
+    }
+    if((get_le16(img->data+6)&HACK_BINARY_SYMBOLS)==0)
+        img->symbol_count=0;
+    img->symbols=(hack_symbol*)calloc(img->symbol_count+1, sizeof(hack_symbol));
+    if(img->symbols==NULL)
+        return 0;
+    const uint8_t *p=img->data+end;
+    const uint8_t *limit=img->data+img->data_size;
+    for(uint32_t i=0; i<img->symbol_count; i++)
+    {
+        if(limit-p<6 || limit-p-6<get_le16(p+4))
+            return 0;
+        int length=get_le16(p+4);
+        img->symbols[i].address=get_le16(p);
+        img->symbols[i].kind=(symbol_kind)get_le16(p+2);
+        img->symbols[i].name=(char*)malloc(length+1);
+        if(img->symbols[i].name==NULL)
+            return 0;
+        memcpy(img->symbols[i].name, p+6, length);
+        img->symbols[i].name[length]='\0';
+        p+=6+length;
+    }
+    return 1;
+}
+
+static inline int hack_image_load_text(hack_image *img)
+{
+    img->rom_copy=(uint16_t*)malloc((img->data_size/HACK_BINARY_HEADER_SIZE+1)*sizeof(uint16_t));
+    if(img->rom_copy==NULL)
+        return 0;
+    uint32_t n=0;
+    uint16_t word=0;
+    int digits=0;
+    for(size_t i=0; i<img->data_size; i++)
+    {
+        uint8_t c=img->data[i];
+        if(c=='0' || c=='1')
+        {
+            word=(uint16_t)((word<<1)|(c-'0'));
+            digits++;
+        }
+        else if(c=='\n')
+        {
+            if(digits==16)
+                img->rom_copy[n++]=word;
+            else if(digits!=0)
+                return 0;
+            word=0;
+            digits=0;
+        }
+        else if(c!='\r' && c!=' ' && c!='\t')
+            return 0;
+    }
+    if(digits==16)
+        img->rom_copy[n++]=word;
+    else if(digits!=0)
+        return 0;
+    img->rom=img->rom_copy;
+    img->word_count=n;
+    return 1;
+}
+
+static inline void hack_image_free(hack_image *img)
+{
+    if(img->symbols!=NULL)
+        for(uint32_t i=0; i<img->symbol_count; i++)
+            free(img->symbols[i].name);
+    free(img->symbols);
+    free(img->rom_copy);
+#ifndef _WIN32
+    if(img->mapped)
+        munmap(img->data, img->data_size);
+    else
+#endif
+        free(img->data);
+    memset(img, 0, sizeof(hack_image));
+}
+
+//loads a binary image or a text .hack file, returns 0 and leaves img empty on failure
+static inline int hack_image_load(const char *filename, hack_image *img)
+{
+    memset(img, 0, sizeof(hack_image));
+    if(hack_image_map(filename, img)==0)
+        return 0;
+    int ok;
+    if(img->data_size>=4 && memcmp(img->data, HACK_BINARY_MAGIC, 4)==0)
+        ok=hack_image_load_binary(img);
+    else
+        ok=hack_image_load_text(img);
+    if(ok==0)
+        hack_image_free(img);
+    return ok;
+}
+
+//replaces the symbols of img with the ones of a .map file, returns 0 (and leaves img alone) on failure
+static inline int hack_map_load(const char *filename, hack_image *img)
+{
+    FILE *f=fopen(filename, "r");
+    if(f==NULL)
+        return 0;
+    uint32_t capacity=64, n=0;
+    hack_symbol *symbols=(hack_symbol*)calloc(capacity, sizeof(hack_symbol));
+    char line[1024], kind[16], name[1000];
+    int address, ok=symbols!=NULL;
+    while(ok && fgets(line, sizeof(line), f)!=NULL)
+    {
+        if(line[0]=='/' || line[0]=='\n' || line[0]=='\r')
+            continue;
+        if(sscanf(line, "%15s %d %999s", kind, &address, name)!=3 || address<0 || address>0xFFFF ||
+            (strcmp(kind, "label")!=0 && strcmp(kind, "variable")!=0))
+        {
+            ok=0;
+            break;
+        }
+        if(n==capacity)
+        {
+            hack_symbol *grown=(hack_symbol*)realloc(symbols, 2*capacity*sizeof(hack_symbol));
+            if(grown==NULL)
+            {
+                ok=0;
+                break;
+            }
+            symbols=grown;
+            capacity*=2;
+        }
+        symbols[n].address=address;
+        symbols[n].kind=strcmp(kind, "label")==0 ? SYMBOL_LABEL : SYMBOL_VARIABLE;
+        symbols[n].name=(char*)malloc(strlen(name)+1);
+        if(symbols[n].name==NULL)
+        {
+            ok=0;
+            break;
+        }
+        strcpy(symbols[n].name, name);
+        n++;
+    }
+    fclose(f);
+    if(!ok)
+    {
+        for(uint32_t i=0; symbols!=NULL && i<n; i++)
+            free(symbols[i].name);
+        free(symbols);
+        return 0;
+    }
+    for(uint32_t i=0; img->symbols!=NULL && i<img->symbol_count; i++)
+        free(img->symbols[i].name);
+    free(img->symbols);
+    img->symbols=symbols;
+    img->symbol_count=n;
+    return 1;
+}
+
+#endif
@@ -0,0 +1,418 @@
+/*Dynamic binary translator from Hack machine code to x86-64, used by HackEmulator --jit.
+
+A block is translated the first time the program jumps to its address. It runs up to and including the next jump
+(or up to a halting loop, the end of the ROM, or HACK_JIT_MAX_BLOCK instructions). Blocks are kept in a table
+indexed by ROM address. Because the target of a Hack jump is whatever is in A, a block always leaves through a
+small lookup stub: it loads the host code of the target from the table and jumps to it, and only falls back to C
+when the target has not been translated yet. While the program runs, its state lives in host registers:
+
+    rbx  RAM base (a flat array of 65536 words, so every 16 bit address is valid)
+    rbp  block table
+    r12  A (only ever written as 16 bit, so the upper bits stay zero and it can be used as an index)
+    r13  D
+    r14  instructions executed, r15 the limit (checked on taken jumps, exactly like the interpreter)
+
+Instruction counts, halting and limits behave like the interpreter in HackEmulator.C, so both stop on the same
+instruction with the same RAM. Only x86-64 hosts with mmap get a JIT, hack_jit_available() tells.*/
+#ifndef HACK_JIT_H
+#define HACK_JIT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define HACK_JIT_ROM_SIZE 32768
+#define HACK_JIT_MAX_BLOCK 1024
+#define HACK_JIT_MAX_INSN_BYTES 128 //more than the longest translation of one Hack instruction, with the block exit
+#define HACK_JIT_CODE_SIZE (16<<20)
+
+typedef enum{
+    HACK_JIT_HALT,
+    HACK_JIT_END,
+    HACK_JIT_LIMIT,
+    HACK_JIT_UNAVAILABLE
+}hack_jit_result;
+
+#if defined(__x86_64__) && !defined(_WIN32) && !defined(HACK_NO_JIT)
+#include <sys/mman.h>
+
+//exit codes returned by the generated code: the ROM address to continue at, plus one of these flags
+#define HACK_JIT_EXIT_MISS 0x10000
+#define HACK_JIT_EXIT_LIMIT 0x20000
+
+typedef struct{
+    uint16_t *ram; //offset 0
+    void **table; //8
+    uint64_t cycles; //16
+    uint64_t limit; //24
+    uint32_t A; //32
+    uint32_t D; //36
+}hack_jit_context;
+
+enum{
+    RAX=0, RCX=1, RDX=2, RBX=3, RSP=4, RBP=5, RSI=6, RDI=7,
+    R12=12, R13=13, R14=14, R15=15
+};
+
+typedef enum{
+    OPERAND_REG,
+    OPERAND_M, //word [rbx+r12*2]
+    OPERAND_M_CONST //word [rbx+disp32], when the block knows the value of A
+}operand_kind;
+
+typedef struct{
+    operand_kind kind;
+    int reg;
+    int32_t disp;
+}operand;
+
+typedef struct{
+    uint8_t *code;
+    size_t used;
+    uint8_t *enter; //uint32_t enter(hack_jit_context*, void *block)
+    uint8_t *lookup; //eax: ROM address of the next block
+    uint8_t *exit_limit;
+    uint8_t *exit;
+    size_t stubs_size;
+    void *table[HACK_JIT_ROM_SIZE+1];
+}hack_jit;
+
+static inline void jit_byte(hack_jit *jit, uint8_t b)
+{
+    jit->code[jit->used++]=b;
+}
+
+static inline void jit_bytes(hack_jit *jit, const uint8_t *b, size_t n)
+{
+    memcpy(jit->code+jit->used, b, n);
+    jit->used+=n;
+}
+
+static inline void jit_u32(hack_jit *jit, uint32_t v)
+{
+    for(int i=0; i<4; i++)
+        jit_byte(jit, (v>>(8*i))&0xFF);
+}
+
+static inline void jit_rel32(hack_jit *jit, const uint8_t *target)
+{
+    //relative to the end of the 4 byte displacement
+    jit_u32(jit, (uint32_t)(int32_t)(target-(jit->code+jit->used+4)));
+}
+
+static inline operand reg_operand(int reg)
+{
+    operand o={OPERAND_REG, reg, 0};
+    return o;
+}
+
+//[66] [REX] opcode modrm [sib] [disp32]
+static inline void jit_op(hack_jit *jit, bool word16, const char *opcode, int reg, operand rm)
+{
+    if(word16)
+        jit_byte(jit, 0x66);
+    uint8_t rex=0;
+    if(reg&8)
+        rex|=0x04;
+    if(rm.kind==OPERAND_M)
+        rex|=0x02; //r12 as index
+    if(rm.kind==OPERAND_REG && (rm.reg&8))
+        rex|=0x01;
+    if(rex)
+        jit_byte(jit, 0x40|rex);
+    for(int i=0; opcode[i]!='\0'; i++)
+        jit_byte(jit, (uint8_t)opcode[i]);
+    if(rm.kind==OPERAND_REG)
+        jit_byte(jit, 0xC0|((reg&7)<<3)|(rm.reg&7));
+    else if(rm.kind==OPERAND_M)
+    {
+        jit_byte(jit, 0x04|((reg&7)<<3));
+        jit_byte(jit, 0x40|((R12&7)<<3)|RBX); //scale 2, index r12, base rbx
+    }
+    else
+    {
+        jit_byte(jit, 0x80|((reg&7)<<3)|RBX);
+        jit_u32(jit, (uint32_t)rm.disp);
+    }
+}
+
+#define MOVZX16 "\x0F\xB7"
+#define MOV_STORE "\x89"
+#define ADD16 "\x03"
+#define SUB16 "\x2B"
+#define AND16 "\x23"
+#define OR16 "\x0B"
+#define GROUP_F7 "\xF7" //reg field 2: not, 3: neg
+#define GROUP_FF "\xFF" //reg field 0: inc, 1: dec
+
+static inline void jit_build_stubs(hack_jit *jit)
+{
+    static const uint8_t enter[]={
+        0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57, //push rbx, rbp, r12-r15
+        0x57, //push rdi (the context, needed again on exit)
+        0x48, 0x8B, 0x1F, //mov rbx, [rdi]
+        0x48, 0x8B, 0x6F, 0x08, //mov rbp, [rdi+8]
+        0x4C, 0x8B, 0x77, 0x10, //mov r14, [rdi+16]
+        0x4C, 0x8B, 0x7F, 0x18, //mov r15, [rdi+24]
+        0x44, 0x8B, 0x67, 0x20, //mov r12d, [rdi+32]
+        0x44, 0x8B, 0x6F, 0x24, //mov r13d, [rdi+36]
+        0xFF, 0xE6 //jmp rsi
+    };
+    static const uint8_t exit[]={
+        0x5F, //pop rdi
+        0x44, 0x89, 0x67, 0x20, //mov [rdi+32], r12d
+        0x44, 0x89, 0x6F, 0x24, //mov [rdi+36], r13d
+        0x4C, 0x89, 0x77, 0x10, //mov [rdi+16], r14
+        0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5D, 0x5B, //pop r15-r12, rbp, rbx
+        0xC3 //ret
+    };
+    jit->enter=jit->code+jit->used;
+    jit_bytes(jit, enter, sizeof(enter));
+    jit->exit=jit->code+jit->used;
+    jit_bytes(jit, exit, sizeof(exit));
+    jit->exit_limit=jit->code+jit->used;
+    jit_byte(jit, 0x0D); //or eax, HACK_JIT_EXIT_LIMIT
+    jit_u32(jit, HACK_JIT_EXIT_LIMIT);
+    jit_byte(jit, 0xE9); //jmp exit
+    jit_rel32(jit, jit->exit);
+    jit->lookup=jit->code+jit->used;
+    static const uint8_t lookup[]={
+        0x48, 0x8B, 0x4C, 0xC5, 0x00, //mov rcx, [rbp+rax*8]
+        0x48, 0x85, 0xC9, //test rcx, rcx
+        0x74, 0x02, //jz miss
+        0xFF, 0xE1 //jmp rcx
+    };
+    jit_bytes(jit, lookup, sizeof(lookup));
+    jit_byte(jit, 0x0D); //miss: or eax, HACK_JIT_EXIT_MISS
+    jit_u32(jit, HACK_JIT_EXIT_MISS);
+    jit_byte(jit, 0xE9); //jmp exit
+    jit_rel32(jit, jit->exit);
+    jit->stubs_size=jit->used;
+}
+
+//eax=comp(D, A or M), the upper half of eax stays zero
+static inline void jit_comp(hack_jit *jit, int comp, operand y)
+{
+    operand d=reg_operand(R13);
+    operand ax=reg_operand(RAX);
+    switch(comp)
+    {
+        case 0x2A: jit_bytes(jit, (const uint8_t*)"\x31\xC0", 2); return; //xor eax, eax
+        case 0x3F: jit_byte(jit, 0xB8); jit_u32(jit, 1); return;
+        case 0x3A: jit_byte(jit, 0xB8); jit_u32(jit, 0xFFFF); return;
+        case 0x0C: jit_op(jit, false, MOVZX16, RAX, d); return;
+        case 0x30: case 0x70: jit_op(jit, false, MOVZX16, RAX, y); return;
+        case 0x0D: jit_op(jit, false, MOVZX16, RAX, d); jit_op(jit, true, GROUP_F7, 2, ax); return;
+        case 0x31: case 0x71: jit_op(jit, false, MOVZX16, RAX, y); jit_op(jit, true, GROUP_F7, 2, ax); return;
+        case 0x0F: jit_op(jit, false, MOVZX16, RAX, d); jit_op(jit, true, GROUP_F7, 3, ax); return;
+        case 0x33: case 0x73: jit_op(jit, false, MOVZX16, RAX, y); jit_op(jit, true, GROUP_F7, 3, ax); return;
+        case 0x1F: jit_op(jit, false, MOVZX16, RAX, d); jit_op(jit, true, GROUP_FF, 0, ax); return;
+        case 0x37: case 0x77: jit_op(jit, false, MOVZX16, RAX, y); jit_op(jit, true, GROUP_FF, 0, ax); return;
+        case 0x0E: jit_op(jit, false, MOVZX16, RAX, d); jit_op(jit, true, GROUP_FF, 1, ax); return;
+        case 0x32: case 0x72: jit_op(jit, false, MOVZX16, RAX, y); jit_op(jit, true, GROUP_FF, 1, ax); return;
+        case 0x02: case 0x42: jit_op(jit, false, MOVZX16, RAX, d); jit_op(jit, true, ADD16, RAX, y); return;
+        case 0x13: case 0x53: jit_op(jit, false, MOVZX16, RAX, d); jit_op(jit, true, SUB16, RAX, y); return;
+        case 0x07: case 0x47: jit_op(jit, false, MOVZX16, RAX, y); jit_op(jit, true, SUB16, RAX, d); return;
+        case 0x00: case 0x40: jit_op(jit, false, MOVZX16, RAX, d); jit_op(jit, true, AND16, RAX, y); return;
+        case 0x15: case 0x55: jit_op(jit, false, MOVZX16, RAX, d); jit_op(jit, true, OR16, RAX, y); return;
+    }
+    //any other ALU bit pattern: x in eax, y in ecx, then zx nx zy ny f no
+    operand cx=reg_operand(RCX);
+    if(comp&0x20)
+        jit_bytes(jit, (const uint8_t*)"\x31\xC0", 2);
+    else
+        jit_op(jit, false, MOVZX16, RAX, d);
+    if(comp&0x10)
+        jit_op(jit, true, GROUP_F7, 2, ax);
+    if(comp&0x08)
+        jit_bytes(jit, (const uint8_t*)"\x31\xC9", 2); //xor ecx, ecx
+    else
+        jit_op(jit, false, MOVZX16, RCX, y);
+    if(comp&0x04)
+        jit_op(jit, true, GROUP_F7, 2, cx);
+    jit_op(jit, true, (comp&0x02) ? ADD16 : AND16, RAX, cx);
+    if(comp&0x01)
+        jit_op(jit, true, GROUP_F7, 2, ax);
+}
+
+static inline bool jit_halts(const uint16_t *rom, uint32_t size, uint32_t pc)
+{
+    return pc+1<size && rom[pc]==pc && rom[pc+1]==0xEA87; //@pc, 0;JMP
+}
+
+static inline void jit_fall_through(hack_jit *jit, uint32_t next)
+{
+    jit_byte(jit, 0xB8); //mov eax, next
+    jit_u32(jit, next);
+    jit_byte(jit, 0xE9);
+    jit_rel32(jit, jit->lookup);
+}
+
+static inline uint8_t *jit_translate(hack_jit *jit, const uint16_t *rom, uint32_t size, uint32_t start)
+{
+    uint8_t *block=jit->code+jit->used;
+    //the block length is only known at the end, so the cycle count is patched afterwards
+    jit_bytes(jit, (const uint8_t*)"\x49\x81\xC6", 3); //add r14, imm32
+    size_t count_at=jit->used;
+    jit_u32(jit, 0);
+    int a_const=-1; //value of A when this block knows it
+    bool jumped=false;
+    uint32_t pc=start;
+    for(; pc<size && pc-start<HACK_JIT_MAX_BLOCK && !jit_halts(rom, size, pc); pc++)
+    {
+        uint16_t word=rom[pc];
+        if((word&0x8000)==0)
+        {
+            jit_bytes(jit, (const uint8_t*)"\x66\x41\xBC", 3); //mov r12w, imm16
+            jit_byte(jit, word&0xFF);
+            jit_byte(jit, word>>8);
+            a_const=word;
+            continue;
+        }
+        int comp=(word>>6)&0x7F, dest=(word>>3)&0x7, jump=word&0x7;
+        operand m={OPERAND_M, 0, 0};
+        if(a_const>=0)
+        {
+            m.kind=OPERAND_M_CONST;
+            m.disp=2*a_const;
+        }
+        jit_comp(jit, comp, (comp&0x40) ? m : reg_operand(R12));
+        int target_const=a_const;
+        if(jump!=0 && target_const<0 && (dest&4))
+            jit_bytes(jit, (const uint8_t*)"\x41\x8B\xD4", 3); //mov edx, r12d: the jump goes to the old A
+        if(dest&1)
+            jit_op(jit, true, MOV_STORE, RAX, m);
+        if(dest&4)
+        {
+            jit_op(jit, true, MOV_STORE, RAX, reg_operand(R12));
+            a_const=-1;
+        }
+        if(dest&2)
+            jit_op(jit, true, MOV_STORE, RAX, reg_operand(R13));
+        if(jump==0)
+            continue;
+        //the block ends here
+        static const uint8_t taken_if[8]={0, 0x8F, 0x84, 0x8D, 0x8C, 0x85, 0x8E, 0}; //jg je jge jl jne jle
+        size_t skip_at=0;
+        if(jump!=7)
+        {
+            jit_bytes(jit, (const uint8_t*)"\x66\x85\xC0", 3); //test ax, ax
+            jit_byte(jit, 0x0F);
+            jit_byte(jit, taken_if[jump]^1); //the opposite condition skips the taken path
+            skip_at=jit->used;
+            jit_u32(jit, 0);
+        }
+        if(target_const>=0)
+        {
+            jit_byte(jit, 0xB8);
+            jit_u32(jit, target_const&0x7FFF);
+        }
+        else
+        {
+            if(dest&4)
+                jit_bytes(jit, (const uint8_t*)"\x89\xD0", 2); //mov eax, edx
+            else
+                jit_op(jit, false, MOVZX16, RAX, reg_operand(R12));
+            jit_byte(jit, 0x25); //and eax, 0x7FFF
+            jit_u32(jit, 0x7FFF);
+        }
+        jit_bytes(jit, (const uint8_t*)"\x4D\x39\xFE\x0F\x83", 5); //cmp r14, r15; jae exit_limit
+        jit_rel32(jit, jit->exit_limit);
+        jit_byte(jit, 0xE9);
+        jit_rel32(jit, jit->lookup);
+        if(jump!=7)
+        {
+            uint32_t rel=(uint32_t)(jit->used-(skip_at+4));
+            memcpy(jit->code+skip_at, &rel, 4);
+            jit_fall_through(jit, pc+1);
+        }
+        jumped=true;
+        pc++;
+        break;
+    }
+    uint32_t count=pc-start;
+    memcpy(jit->code+count_at, &count, 4);
+    if(jumped==false)
+        jit_fall_through(jit, pc); //no jump at the end: continue with the next address
+    return block;
+}
+
+static inline int hack_jit_available()
+{
+    return 1;
+}
+
+//runs rom from address 0 on ram until it halts, runs past the end or has executed limit instructions
+static inline hack_jit_result hack_jit_run(const uint16_t *rom, uint32_t size, uint16_t *ram, uint64_t limit, uint64_t *cycles)
+{
+    hack_jit *jit=(hack_jit*)calloc(1, sizeof(hack_jit));
+    if(jit==NULL)
+        return HACK_JIT_UNAVAILABLE;
+    void *code=mmap(NULL, HACK_JIT_CODE_SIZE, PROT_READ|PROT_WRITE|PROT_EXEC, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(code==MAP_FAILED)
+    {
+        free(jit);
+        return HACK_JIT_UNAVAILABLE;
+    }
+    jit->code=(uint8_t*)code;
+    jit_build_stubs(jit);
+    if(size>HACK_JIT_ROM_SIZE)
+        size=HACK_JIT_ROM_SIZE;
+    hack_jit_context context={ram, jit->table, 0, limit, 0, 0};
+    uint32_t (*enter)(hack_jit_context*, void*)=(uint32_t (*)(hack_jit_context*, void*))(void*)jit->enter;
+    hack_jit_result result;
+    uint32_t pc=0;
+    for(;;)
+    {
+        if(pc>=size)
+        {
+            result=HACK_JIT_END;
+            break;
+        }
+        if(jit_halts(rom, size, pc))
+        {
+            result=HACK_JIT_HALT;
+            break;
+        }
+        if(jit->table[pc]==NULL)
+        {
+            if(jit->used+(HACK_JIT_MAX_BLOCK+2)*HACK_JIT_MAX_INSN_BYTES>HACK_JIT_CODE_SIZE)
+            {
+                //out of code space: start over with an empty cache
+                memset(jit->table, 0, sizeof(jit->table));
+                jit->used=jit->stubs_size;
+            }
+            jit->table[pc]=jit_translate(jit, rom, size, pc);
+        }
+        uint32_t exit=enter(&context, jit->table[pc]);
+        pc=exit&0xFFFF;
+        if(exit&HACK_JIT_EXIT_LIMIT)
+        {
+            result=HACK_JIT_LIMIT;
+            break;
+        }
+    }
+    *cycles=context.cycles;
+    munmap(code, HACK_JIT_CODE_SIZE);
+    free(jit);
+    return result;
+}
+
+#else
+
+static inline int hack_jit_available()
+{
+    return 0;
+}
+
+static inline hack_jit_result hack_jit_run(const uint16_t *rom, uint32_t size, uint16_t *ram, uint64_t limit, uint64_t *cycles)
+{
+    (void)rom; (void)size; (void)ram; (void)limit;
+    *cycles=0;
+    return HACK_JIT_UNAVAILABLE;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,359 @@
+/*Parser for the VM language, shared by VMtranslator.C and VMEmulator.C (each includes it from its only file).
+
+openVMfile() maps a .vm file and appends one vm_command record per command to vm[]: a C_FILE record with the
+file name first, then the commands in order. Labels, function and file names are interned, a record only keeps
+the id and symbolName() gives the text back. Anything that is not a valid command stops the program with the
+file and line. freeCommands() drops the records and names of the calling thread.*/
+#ifndef VM_PARSER_H
+#define VM_PARSER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#define CHUNK 64
+
+typedef enum{
+    C_ADD,
+    C_SUB,
+    C_NEG,
+    C_EQ,
+    C_GT,
+    C_LT,
+    C_AND,
+    C_OR,
+    C_NOT,
+    C_PUSH,
+    C_POP,
+    C_LABEL,
+    C_GOTO,
+    C_IF,
+    C_FUNCTION,
+    C_RETURN,
+    C_CALL,
+    C_FILE, //start of a .vm file, the symbol is the file name without .vm (the prefix of its static variables)
+    null
+}command_type;
+
+typedef enum{
+    S_CONSTANT,
+    S_LOCAL,
+    S_ARGUMENT,
+    S_THIS,
+    S_THAT,
+    S_STATIC,
+    S_TEMP,
+    S_POINTER,
+    S_NONE
+}segment_type;
+
+//one parsed VM command, the loader fills these in once and the code writer only switches over them
+typedef struct{
+    command_type type;
+    segment_type segment;
+    int index; //push/pop index, nLocals of function, nArgs of call
+    int symbol; //interned label/function/file name, -1 if none
+}vm_command;
+
+static const char *command_names[]={"add", "sub", "neg", "eq", "gt", "lt", "and", "or", "not",
+    "push", "pop", "label", "goto", "if-goto", "function", "return", "call"};
+static const char *segment_names[]={"constant", "local", "argument", "this", "that", "static", "temp", "pointer"};
+
+//the parser state is per thread, so that several files can be parsed at the same time
+static thread_local vm_command *vm=NULL;
+static thread_local int command_count=0;
+static thread_local int command_capacity=0;
+
+//interned symbols: the names are stored back to back in symbol_text, symbol_offset[id] is where
+//name id starts and symbol_table is an open addressing hash table of ids (-1 = empty)
+static thread_local char *symbol_text=NULL;
+static thread_local int symbol_text_size=0;
+static thread_local int symbol_text_capacity=0;
+static thread_local int *symbol_offset=NULL;
+static thread_local int symbol_count=0;
+static thread_local int symbol_capacity=0;
+static thread_local int *symbol_table=NULL;
+static thread_local int symbol_table_size=0;
+
+static inline int isDirectory(const char *path)
+{
+    struct stat path_stat;
+    stat(path, &path_stat);
+    return S_ISDIR(path_stat.st_mode); //1 - directory, 0 - not directory
+}
+
+static inline int isVMfile(const char *filename)
+{
+    if(strstr(filename, ".vm")!=NULL)
+        return 1;
+    return 0;
+}
+
+static inline const char *symbolName(int id)
+{
+    return symbol_text+symbol_offset[id];
+}
+
+static inline unsigned int hashSymbol(const char *name, int length)
+{
+    unsigned int hash=2166136261u; //FNV-1a
+    for(int i=0; i<length; i++)
+        hash=(hash^(unsigned char)name[i])*16777619u;
+    return hash;
+}
+
+static inline void growSymbolTable()
+{
+    int new_size=symbol_table_size==0 ? 1024 : symbol_table_size*2;
+    int *table=(int*)malloc(new_size*sizeof(int));
+    if(table==NULL)
+    {
+        fprintf(stderr, "(growSymbolTable) error: memory allocation\n");
+        exit(EXIT_FAILURE);
+    }
+    for(int i=0; i<new_size; i++)
+        table[i]=-1;
+    for(int id=0; id<symbol_count; id++)
+    {
+        const char *name=symbolName(id);
+        unsigned int slot=hashSymbol(name, strlen(name))&(new_size-1);
+        while(table[slot]!=-1)
+            slot=(slot+1)&(new_size-1);
+        table[slot]=id;
+    }
+    free(symbol_table);
+    symbol_table=table;
+    symbol_table_size=new_size;
+}
+
+static inline int internSymbol(const char *name, int length)
+{
+    if(2*(symbol_count+1)>symbol_table_size)
+        growSymbolTable();
+    unsigned int slot=hashSymbol(name, length)&(symbol_table_size-1);
+    for(; symbol_table[slot]!=-1; slot=(slot+1)&(symbol_table_size-1))
+    {
+        const char *other=symbolName(symbol_table[slot]);
+        if(strncmp(other, name, length)==0 && other[length]=='\0')
+            return symbol_table[slot];
+    }
+    if(symbol_count==symbol_capacity)
+    {
+        symbol_capacity=symbol_capacity==0 ? 256 : symbol_capacity*2;
+        int *temp=(int*)realloc(symbol_offset, symbol_capacity*sizeof(int));
+        if(temp==NULL)
+        {
+            fprintf(stderr, "(internSymbol) error: memory allocation\n");
+            exit(EXIT_FAILURE);
+        }
+        symbol_offset=temp;
+    }
+    while(symbol_text_size+length+1>symbol_text_capacity)
+    {
+        symbol_text_capacity=symbol_text_capacity==0 ? 4096 : symbol_text_capacity*2;
+        char *temp=(char*)realloc(symbol_text, symbol_text_capacity);
+        if(temp==NULL)
+        {
+            fprintf(stderr, "(internSymbol) error: memory allocation\n");
+            exit(EXIT_FAILURE);
+        }
+        symbol_text=temp;
+    }
+    memcpy(symbol_text+symbol_text_size, name, length);
+    symbol_text[symbol_text_size+length]='\0';
+    symbol_offset[symbol_count]=symbol_text_size;
+    symbol_text_size+=length+1;
+    symbol_table[slot]=symbol_count;
+    return symbol_count++;
+}
+
+static inline void addCommand(command_type type, segment_type segment, int index, int symbol)
+{
+    if(command_count==command_capacity)
+    {
+        command_capacity=command_capacity==0 ? CHUNK : command_capacity*2;
+        vm_command *temp=(vm_command*)realloc(vm, command_capacity*sizeof(vm_command));
+        if(temp==NULL)
+        {
+            fprintf(stderr, "(addCommand) error: memory allocation\n");
+            exit(EXIT_FAILURE);
+        }
+        vm=temp;
+    }
+    vm[command_count].type=type;
+    vm[command_count].segment=segment;
+    vm[command_count].index=index;
+    vm[command_count].symbol=symbol;
+    command_count++;
+}
+
+static inline void parseError(const char *filename, int line_number, const char *message, const char *token, int length)
+{
+    fprintf(stderr, "(parseLine) error: %s:%d: %s %.*s\n", filename, line_number, message, length, token);
+    exit(EXIT_FAILURE);
+}
+
+static inline int wordIs(const char *word, int length, const char *name)
+{
+    return strncmp(word, name, length)==0 && name[length]=='\0';
+}
+
+//splits one line of the mapped file into at most 3 words (comments and whitespace dropped) and appends
+//its command. The line is not modified and not copied, names are interned straight from it
+static inline void parseLine(const char *line, int length, const char *filename, int line_number)
+{
+    for(int i=0; i+1<length; i++)
+        if(line[i]=='/' && line[i+1]=='/')
+        {
+            length=i;
+            break;
+        }
+    const char *word[4];
+    int word_length[4];
+    int words=0;
+    for(int i=0; i<length && words<4; )
+    {
+        if(line[i]==' ' || line[i]=='\t' || line[i]=='\r')
+        {
+            i++;
+            continue;
+        }
+        word[words]=line+i;
+        while(i<length && line[i]!=' ' && line[i]!='\t' && line[i]!='\r')
+            i++;
+        word_length[words]=line+i-word[words];
+        words++;
+    }
+    if(words==0)
+        return;
+    int type=0;
+    while(type<(int)(sizeof(command_names)/sizeof(command_names[0])) && !wordIs(word[0], word_length[0], command_names[type]))
+        type++;
+    if(type==(int)(sizeof(command_names)/sizeof(command_names[0])))
+        parseError(filename, line_number, "unknown command", word[0], word_length[0]);
+    int expected=(type<=C_NOT || type==C_RETURN) ? 1 : (type==C_LABEL || type==C_GOTO || type==C_IF) ? 2 : 3;
+    if(words!=expected)
+        parseError(filename, line_number, "wrong number of arguments for", word[0], word_length[0]);
+    segment_type segment=S_NONE;
+    int index=0;
+    int symbol=-1;
+    if(type==C_PUSH || type==C_POP)
+    {
+        int s=0;
+        while(s<S_NONE && !wordIs(word[1], word_length[1], segment_names[s]))
+            s++;
+        if(s==S_NONE || (type==C_POP && s==S_CONSTANT))
+            parseError(filename, line_number, "invalid segment", word[1], word_length[1]);
+        segment=(segment_type)s;
+    }
+    else if(words>1)
+        symbol=internSymbol(word[1], word_length[1]);
+    if(words==3)
+    {
+        if(word_length[2]>9)
+            parseError(filename, line_number, "invalid number", word[2], word_length[2]);
+        for(int i=0; i<word_length[2]; i++)
+        {
+            if(word[2][i]<'0' || word[2][i]>'9')
+                parseError(filename, line_number, "invalid number", word[2], word_length[2]);
+            index=index*10+(word[2][i]-'0');
+        }
+    }
+    addCommand((command_type)type, segment, index, symbol);
+}
+
+//maps the file read-only (or reads it whole where there is no mmap) and parses it line by line
+//in place: no line is copied or allocated, only the names end up in the symbol table
+static inline void openVMfile(const char *path, const char *name)
+{
+    char *text=NULL;
+    size_t size=0;
+    int mapped=0;
+#ifndef _WIN32
+    int fd=open(path, O_RDONLY);
+    struct stat st;
+    if(fd>=0 && fstat(fd, &st)==0 && st.st_size>0)
+    {
+        void *p=mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(p!=MAP_FAILED)
+        {
+            text=(char*)p;
+            size=st.st_size;
+            mapped=1;
+        }
+    }
+    if(fd>=0)
+        close(fd);
+#endif
+    if(mapped==0)
+    {
+        FILE *f=fopen(path, "rb");
+        if(f==NULL)
+        {
+            fprintf(stderr, "(openVMfile) error: opening file\n");
+            exit(EXIT_FAILURE);
+        }
+        fseek(f, 0, SEEK_END);
+        long file_size=ftell(f);
+        rewind(f);
+        text=(char*)malloc(file_size>0 ? file_size : 1);
+        if(file_size<0 || text==NULL || (long)fread(text, 1, file_size, f)!=file_size)
+        {
+            fprintf(stderr, "(openVMfile) error: reading file\n");
+            exit(EXIT_FAILURE);
+        }
+        if(fclose(f)!=0)
+        {
+            fprintf(stderr, "(openVMfile) error: closing file\n");
+            exit(EXIT_FAILURE);
+        }
+        size=file_size;
+    }
+
+    //static variables are named after the file: Main.vm -> Main.0, Main.1...
+    addCommand(C_FILE, S_NONE, 0, internSymbol(name, strlen(name)));
+
+    int line_number=0;
+    for(const char *line=text; line<text+size; )
+    {
+        const char *end=(const char*)memchr(line, '\n', text+size-line);
+        if(end==NULL)
+            end=text+size;
+        line_number++;
+        parseLine(line, end-line, path, line_number);
+        line=end+1;
+    }
+
+#ifndef _WIN32
+    if(mapped==1)
+    {
+        munmap(text, size);
+        return;
+    }
+#endif
+    free(text);
+}
+
+static inline void freeCommands()
+{
+    free(vm);
+    free(symbol_text);
+    free(symbol_offset);
+    free(symbol_table);
+    vm=NULL;
+    symbol_text=NULL;
+    symbol_offset=NULL;
+    symbol_table=NULL;
+    command_count=command_capacity=0;
+    symbol_count=symbol_capacity=0;
+    symbol_text_size=symbol_text_capacity=0;
+    symbol_table_size=0;
+}
+
+#endif